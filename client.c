@@ -5,12 +5,33 @@
 //   4) Reads a line from stdin, sends it to server
 //   5) Receives a reply from server and prints it
 //   6) Closes the socket
+//
+// Server list mode:
+//   Instead of "hostname port", several "host:port" servers may be given.
+//   The message is then used as a routing key and sent to the server chosen
+//   by rendezvous (highest-random-weight) hashing, so the same message always
+//   lands on the same instance and adding/removing one server only moves the
+//   keys that belonged to it.
+//
+// Hedged requests:
+//   With -n the message is sent several times and the client measures the
+//   latency of every request. Once it has enough samples, a request that has
+//   not been answered within the observed p95 is duplicated to the next
+//   server in hashing order, the first reply wins and the slower connection
+//   is closed. -b caps the duplicates at a percentage of all requests.
+
+#define _GNU_SOURCE     // ppoll()
 
 #include <stdio.h>      // printf, fprintf, perror
 #include <stdlib.h>     // exit, atoi
-#include <string.h>     // strlen
+#include <string.h>     // strlen, strchr, strrchr, memcpy
+#include <stdint.h>     // uint64_t
 #include <strings.h>    // bzero, bcopy (BSD-style; sometimes discouraged but common in teaching code)
-#include <unistd.h>     // read, write, close
+#include <unistd.h>     // read, write, close, getopt
+#include <poll.h>       // ppoll, struct pollfd
+#include <time.h>       // struct timespec
+
+#include "fastclock.h"  // fastclock_init, fastclock_ns
 
 #include <sys/types.h>  // basic system data types
 #include <sys/socket.h> // socket(), connect()
@@ -24,54 +45,85 @@ static void error(const char *msg) {
     exit(1);
 }
 
-int main(int argc, char *argv[]) {
-    int sockfd;   // file descriptor for the socket
-    int portno;   // server port number
-    int n;        // number of bytes read/written
-
-    // serv_addr holds the server address information (IPv4 + port).
-    struct sockaddr_in serv_addr;
+#define MAX_SERVERS       64
+#define LAT_WINDOW        256   // latency samples kept for the p95 estimate
+#define HEDGE_MIN_SAMPLES 20    // no hedging until this many samples exist
 
-    // server holds the result of DNS lookup (hostname -> IP address).
-    struct hostent *server;
+// One entry of the server list, resolved once at startup.
+struct server {
+    struct sockaddr_in addr;
+    const char *name;   // "host:port", also the server's hashing identity
+};
 
-    // buffer for sending/receiving data.
-    char buffer[256];
+// ----------------------------------------------------------------------------
+// hash64():
+// FNV-1a over the bytes, mixed with a seed and finished with the SplitMix64
+// finalizer so that nearby inputs give unrelated outputs.
+// ----------------------------------------------------------------------------
+static uint64_t hash64(const char *data, size_t len, uint64_t seed) {
+    uint64_t h = 14695981039346656037ULL ^ seed;
+    size_t i;
 
-    // ------------------------------------------------------------------------
-    // 1) Check command-line arguments:
-    //    The client expects TWO arguments: hostname and port.
-    // ------------------------------------------------------------------------
-    if (argc < 3) {
-        fprintf(stderr, "usage %s hostname port\n", argv[0]);
-        exit(1);
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
     }
 
-    // ------------------------------------------------------------------------
-    // 2) Convert the port argument (string) to an integer.
-    // ------------------------------------------------------------------------
-    portno = atoi(argv[2]);
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
 
-    // ------------------------------------------------------------------------
-    // 3) Create a socket:
-    //    - AF_INET      : IPv4
-    //    - SOCK_STREAM  : TCP (reliable byte-stream)
-    //    - 0            : choose the default protocol for SOCK_STREAM (TCP)
-    //    socket() returns a file descriptor. If it fails, it returns -1.
-    // ------------------------------------------------------------------------
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        error("ERROR opening socket");
+// ----------------------------------------------------------------------------
+// pick_server():
+// Rendezvous hashing: every server gets a score hash(key, server) and the
+// highest score wins. Removing a server only re-routes the keys it owned;
+// adding one only takes over the keys it now wins (about 1/n of them).
+// Server 'exclude' is skipped, which gives the runner-up for hedging
+// (pass -1 to consider every server).
+// ----------------------------------------------------------------------------
+static int pick_server(const struct server *servers, int nservers,
+                       const char *key, size_t keylen, int exclude) {
+    uint64_t best_score = 0;
+    int best = -1;
+    int i;
+
+    for (i = 0; i < nservers; i++) {
+        uint64_t seed = hash64(servers[i].name, strlen(servers[i].name), 0);
+        uint64_t score = hash64(key, keylen, seed);
+
+        if (i == exclude)
+            continue;
+        if (best < 0 || score > best_score) {
+            best_score = score;
+            best = i;
+        }
     }
+    return best;
+}
+
+// ----------------------------------------------------------------------------
+// resolve_server():
+// Steps 4) and 5) of the client: resolve the host and fill in the server
+// address. Done once per server, so no DNS lookup is ever part of a timed
+// request.
+// ----------------------------------------------------------------------------
+static void resolve_server(struct server *srv, const char *host, int portno,
+                           const char *name) {
+    // server holds the result of DNS lookup (hostname -> IP address).
+    struct hostent *server;
 
     // ------------------------------------------------------------------------
     // 4) Resolve hostname -> IP address using DNS/hosts database:
     //    gethostbyname() returns a pointer to a hostent struct if successful.
     //    If it fails, it returns NULL.
     // ------------------------------------------------------------------------
-    server = gethostbyname(argv[1]);
+    server = gethostbyname(host);
     if (server == NULL) {
-        fprintf(stderr, "ERROR, no such host\n");
+        fprintf(stderr, "ERROR, no such host: %s\n", host);
         exit(1);
     }
 
@@ -80,16 +132,16 @@ int main(int argc, char *argv[]) {
     //    - bzero() clears the struct to avoid garbage values in unused fields.
     //    - sin_family must be AF_INET for IPv4.
     // ------------------------------------------------------------------------
-    bzero((char *)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
+    bzero((char *)&srv->addr, sizeof(srv->addr));
+    srv->addr.sin_family = AF_INET;
 
     // ------------------------------------------------------------------------
-    // 5.1) Copy the resolved IP address into serv_addr.sin_addr.s_addr:
+    // 5.1) Copy the resolved IP address into addr.sin_addr.s_addr:
     //      server->h_addr points to the first IP address in the result.
     //      server->h_length indicates the length of the address in bytes.
     // ------------------------------------------------------------------------
     bcopy((char *)server->h_addr,
-          (char *)&serv_addr.sin_addr.s_addr,
+          (char *)&srv->addr.sin_addr.s_addr,
           server->h_length);
 
     // ------------------------------------------------------------------------
@@ -97,50 +149,298 @@ int main(int argc, char *argv[]) {
     //      htons() converts from host byte order (often little-endian) to
     //      network byte order (big-endian).
     // ------------------------------------------------------------------------
-    serv_addr.sin_port = htons(portno);
+    srv->addr.sin_port = htons(portno);
+    srv->name = name;
+}
+
+// ----------------------------------------------------------------------------
+// parse_server():
+// Splits and resolves a "host:port" argument into a server list entry.
+// ----------------------------------------------------------------------------
+static void parse_server(struct server *srv, const char *arg) {
+    const char *colon = strrchr(arg, ':');
+    char host[256];
+    size_t len;
+
+    if (colon == NULL || (len = colon - arg) >= sizeof(host)) {
+        fprintf(stderr, "ERROR, server must be host:port: %s\n", arg);
+        exit(1);
+    }
+    memcpy(host, arg, len);
+    host[len] = '\0';
+    resolve_server(srv, host, atoi(colon + 1), arg);
+}
+
+// ----------------------------------------------------------------------------
+// connect_to():
+// Steps 3) and 6) of the client: create a socket and connect it to the
+// server. Returns the connected socket, or -1 (errno set) if the server
+// cannot be reached, so a failed hedge does not end the client.
+// ----------------------------------------------------------------------------
+static int connect_to(const struct server *srv) {
+    int sockfd;   // file descriptor for the socket
+
+    // ------------------------------------------------------------------------
+    // 3) Create a socket:
+    //    - AF_INET      : IPv4
+    //    - SOCK_STREAM  : TCP (reliable byte-stream)
+    //    - 0            : choose the default protocol for SOCK_STREAM (TCP)
+    //    socket() returns a file descriptor. If it fails, it returns -1.
+    // ------------------------------------------------------------------------
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        error("ERROR opening socket");
+    }
 
     // ------------------------------------------------------------------------
     // 6) Connect to the server:
     //    connect() performs the TCP 3-way handshake with the server.
     //    If connect() fails, it returns -1.
     // ------------------------------------------------------------------------
-    if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        error("ERROR connecting");
+    if (connect(sockfd, (const struct sockaddr *)&srv->addr,
+                sizeof(srv->addr)) < 0) {
+        close(sockfd);
+        return -1;
     }
 
-    // ------------------------------------------------------------------------
-    // 7) Send a message to the server:
-    //    - Read a line from stdin using fgets()
-    //    - write() sends bytes through the connected TCP socket
-    // ------------------------------------------------------------------------
-    printf("Please enter the message: ");
-    bzero(buffer, sizeof(buffer));           // clear buffer
-    fgets(buffer, sizeof(buffer) - 1, stdin); // read up to 255 chars + '\0'
+    return sockfd;
+}
 
-    n = write(sockfd, buffer, strlen(buffer));
-    if (n < 0) {
-        error("ERROR writing to socket");
+// ----------------------------------------------------------------------------
+// Latency tracking:
+// The last LAT_WINDOW request latencies (microseconds) in a ring buffer,
+// which gives the recent p95 the hedging decision needs. Every latency is
+// also kept in all_us[] (sized for -n) for the end-of-run summary.
+// ----------------------------------------------------------------------------
+static long lat_us[LAT_WINDOW];
+static int nlat;            // samples stored, at most LAT_WINDOW
+static int lat_next;        // ring position of the next sample
+
+static long *all_us;        // every latency of the run, in request order
+static long nall;           // samples stored in all_us
+
+static long requests_sent;  // requests issued so far
+static long hedges_sent;    // of which were duplicated to a second server
+
+static long now_us(void) {
+    return fastclock_ns() / 1000;
+}
+
+static void record_latency(long us) {
+    lat_us[lat_next] = us;
+    lat_next = (lat_next + 1) % LAT_WINDOW;
+    if (nlat < LAT_WINDOW)
+        nlat++;
+    all_us[nall++] = us;
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Returns the pct-th percentile of the last LAT_WINDOW latencies (0 if none).
+static long percentile_us(int pct) {
+    long sorted[LAT_WINDOW];
+
+    if (nlat == 0)
+        return 0;
+    memcpy(sorted, lat_us, nlat * sizeof(long));
+    qsort(sorted, nlat, sizeof(long), cmp_long);
+    return sorted[(nlat - 1) * pct / 100];
+}
+
+// Returns the pct-th percentile of all latencies of the run (0 if none).
+// Sorts all_us[] in place, so call it only once the run is over.
+static long run_percentile_us(int pct) {
+    if (nall == 0)
+        return 0;
+    qsort(all_us, nall, sizeof(long), cmp_long);
+    return all_us[(nall - 1) * pct / 100];
+}
+
+// Connects to a server and sends the message, returning the socket or -1.
+static int send_message(const struct server *srv, const char *msg) {
+    int sockfd = connect_to(srv);
+
+    if (sockfd < 0)
+        return -1;
+    if (write(sockfd, msg, strlen(msg)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// ----------------------------------------------------------------------------
+// do_request():
+// Sends 'msg' to its server and reads the reply into 'reply'.
+//
+// If hedging is possible (a second server, enough latency samples and room
+// in the budget), the client waits only up to the observed p95 for the
+// primary. After that a duplicate goes to the runner-up server, whichever
+// answers first wins, and the loser is cancelled by closing its connection.
+// A backup that cannot be reached is simply not used: the request keeps
+// waiting for the primary and does not count against the budget.
+// ----------------------------------------------------------------------------
+static void do_request(const struct server *servers, int nservers,
+                       const char *msg, char *reply, size_t replylen,
+                       int budget_pct) {
+    struct pollfd fds[2];
+    int nfds = 1;
+    int primary, i, n;
+    long start = now_us();
+
+    primary = pick_server(servers, nservers, msg, strlen(msg), -1);
+    fds[0].fd = send_message(&servers[primary], msg);
+    if (fds[0].fd < 0) {
+        error("ERROR sending to server");
+    }
+    fds[0].events = POLLIN;
+    requests_sent++;
+
+    if (nservers > 1 && nlat >= HEDGE_MIN_SAMPLES &&
+        hedges_sent * 100 < budget_pct * requests_sent) {
+        long p95 = percentile_us(95);
+        struct timespec hedge_after = { p95 / 1000000, (p95 % 1000000) * 1000 };
+
+        n = ppoll(fds, 1, &hedge_after, NULL);
+        if (n < 0) {
+            error("ERROR on poll");
+        }
+        if (n == 0) {
+            int backup = pick_server(servers, nservers, msg, strlen(msg),
+                                     primary);
+
+            fds[1].fd = send_message(&servers[backup], msg);
+            fds[1].events = POLLIN;
+            if (fds[1].fd >= 0) {
+                nfds = 2;
+                hedges_sent++;
+            }
+        }
     }
 
     // ------------------------------------------------------------------------
     // 8) Receive the server reply:
-    //    read() will block until data arrives (or connection is closed).
+    //    poll() blocks until one of the connections has data (or is closed);
+    //    the first one to answer provides the reply.
     // ------------------------------------------------------------------------
-    bzero(buffer, sizeof(buffer));
-    n = read(sockfd, buffer, sizeof(buffer) - 1);
+    if (poll(fds, nfds, -1) < 0) {
+        error("ERROR on poll");
+    }
+    for (i = 0; i < nfds && fds[i].revents == 0; i++)
+        ;
+
+    bzero(reply, replylen);
+    n = read(fds[i].fd, reply, replylen - 1);
     if (n < 0) {
         error("ERROR reading from socket");
     }
-
-    // Print what we received from the server.
-    printf("%s\n", buffer);
+    record_latency(now_us() - start);
 
     // ------------------------------------------------------------------------
-    // 9) Close the socket:
+    // 9) Close the sockets:
     //    Always close file descriptors to free OS resources and properly
-    //    terminate the TCP connection.
+    //    terminate the TCP connection. Closing the slower connection of a
+    //    hedged pair also cancels it on the server side.
     // ------------------------------------------------------------------------
-    close(sockfd);
+    for (i = 0; i < nfds; i++)
+        close(fds[i].fd);
+}
+
+int main(int argc, char *argv[]) {
+    // servers to choose from; a single entry in "hostname port" mode.
+    struct server servers[MAX_SERVERS];
+    int nservers = 0;
+
+    // buffers for the message and the server's reply.
+    char buffer[256];
+    char reply[256];
+
+    long count = 1;         // -n: number of times the message is sent
+    int budget_pct = 5;     // -b: max hedged requests, percent of all sent
+    int opt, i;
+    long r;
+
+    // ------------------------------------------------------------------------
+    // 1) Check command-line arguments:
+    //    Either TWO arguments (hostname and port) or a list of host:port,
+    //    optionally preceded by -n count and -b hedge budget (percent).
+    // ------------------------------------------------------------------------
+    while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = atol(optarg);
+            break;
+        case 'b':
+            budget_pct = atoi(optarg);
+            break;
+        default:
+            argc = 0;   // fall through to the usage message below
+        }
+    }
+    if (argc == 0 || argc - optind < 1 ||
+        (argc - optind < 2 && strchr(argv[optind], ':') == NULL) ||
+        count < 1) {
+        fprintf(stderr, "usage %s [-n count] [-b hedge_pct] hostname port\n",
+                argv[0]);
+        fprintf(stderr, "      %s [-n count] [-b hedge_pct] host:port [host:port ...]\n",
+                argv[0]);
+        exit(1);
+    }
+
+    // Calibrate the clock used to time requests (see fastclock.h)
+    fastclock_init();
+
+    // Room for every latency of the run, for the summary
+    all_us = malloc(count * sizeof(long));
+    if (all_us == NULL) {
+        error("ERROR allocating latency samples");
+    }
+
+    // ------------------------------------------------------------------------
+    // 2) Build the server list, converting port arguments to integers.
+    //    Every server is resolved here, once, instead of on each request.
+    // ------------------------------------------------------------------------
+    if (strchr(argv[optind], ':') == NULL) {
+        resolve_server(&servers[0], argv[optind], atoi(argv[optind + 1]),
+                       argv[optind]);
+        nservers = 1;
+    } else {
+        if (argc - optind > MAX_SERVERS) {
+            fprintf(stderr, "ERROR, at most %d servers\n", MAX_SERVERS);
+            exit(1);
+        }
+        for (i = optind; i < argc; i++)
+            parse_server(&servers[nservers++], argv[i]);
+    }
+
+    // ------------------------------------------------------------------------
+    // 7) Send a message to the server:
+    //    - Read a line from stdin using fgets()
+    //    - The message is the routing key that picks the server
+    //    - write() sends bytes through the connected TCP socket
+    // ------------------------------------------------------------------------
+    printf("Please enter the message: ");
+    bzero(buffer, sizeof(buffer));           // clear buffer
+    fgets(buffer, sizeof(buffer) - 1, stdin); // read up to 255 chars + '\0'
+
+    for (r = 0; r < count; r++)
+        do_request(servers, nservers, buffer, reply, sizeof(reply), budget_pct);
+
+    // Print what we received from the server.
+    printf("%s\n", reply);
+
+    if (count > 1) {
+        printf("%ld requests, latency p50 %ld us, p95 %ld us, p99 %ld us, "
+               "hedged %ld (%.1f%%)\n",
+               requests_sent, run_percentile_us(50), run_percentile_us(95),
+               run_percentile_us(99), hedges_sent,
+               100.0 * hedges_sent / requests_sent);
+    }
 
+    free(all_us);
     return 0;
 }
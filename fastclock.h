@@ -0,0 +1,89 @@
+// fastclock.h
+//   Cheap monotonic timestamps in nanoseconds, shared by fork_server.c and
+//   client.c.
+//
+//   On x86-64 CPUs with an invariant TSC (constant rate, never stops), the
+//   time is computed from rdtsc, calibrated once against CLOCK_MONOTONIC by
+//   fastclock_init(). Elsewhere (including 32-bit x86), or if the TSC cannot be trusted, it falls
+//   back to clock_gettime(CLOCK_MONOTONIC), which glibc serves from the vDSO
+//   without entering the kernel.
+//
+//   fastclock_ns() is async-signal-safe and keeps working across fork(), so
+//   it can be used from signal handlers and children alike.
+
+#ifndef FASTCLOCK_H
+#define FASTCLOCK_H
+
+#include <stdint.h>     // uint64_t
+#include <time.h>       // clock_gettime, CLOCK_MONOTONIC
+
+// x86-64 only: the 32.32 scaling below needs unsigned __int128
+#ifdef __x86_64__
+#include <cpuid.h>      // __get_cpuid
+#include <x86intrin.h>  // __rdtsc
+#define FASTCLOCK_HAVE_TSC 1
+#endif
+
+#define FASTCLOCK_CALIBRATE_NS 5000000  // calibration window (5 ms)
+
+// Calibration, filled in by fastclock_init()
+static int fastclock_use_tsc;       // 0 = clock_gettime() fallback
+static uint64_t fastclock_base_tsc; // TSC at calibration
+static uint64_t fastclock_base_ns;  // CLOCK_MONOTONIC at calibration
+static uint64_t fastclock_mult;     // ns per tick, 32.32 fixed point
+
+static inline uint64_t fastclock_mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Returns the current time in nanoseconds (CLOCK_MONOTONIC epoch)
+static inline uint64_t fastclock_ns(void)
+{
+#ifdef FASTCLOCK_HAVE_TSC
+    if (fastclock_use_tsc) {
+        uint64_t ticks = __rdtsc() - fastclock_base_tsc;
+
+        return fastclock_base_ns +
+               (uint64_t)(((unsigned __int128)ticks * fastclock_mult) >> 32);
+    }
+#endif
+    return fastclock_mono_ns();
+}
+
+// -----------------------------------------------------------------------------
+// fastclock_init():
+// Decides between TSC and clock_gettime() and calibrates the TSC rate.
+// Call once at startup, before fork(); it busy-waits for about 5 ms.
+// -----------------------------------------------------------------------------
+static inline void fastclock_init(void)
+{
+#ifdef FASTCLOCK_HAVE_TSC
+    unsigned int eax, ebx, ecx, edx;
+    uint64_t t0, t1, c0, c1;
+
+    // CPUID 0x80000007, EDX bit 8: invariant TSC
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8)))
+        return;
+
+    t0 = fastclock_mono_ns();
+    c0 = __rdtsc();
+    do {
+        t1 = fastclock_mono_ns();
+    } while (t1 - t0 < FASTCLOCK_CALIBRATE_NS);
+    c1 = __rdtsc();
+
+    if (c1 <= c0)
+        return;     // TSC not usable (e.g. not advancing under a hypervisor)
+
+    fastclock_mult = ((t1 - t0) << 32) / (c1 - c0);
+    fastclock_base_tsc = c1;
+    fastclock_base_ns = t1;
+    fastclock_use_tsc = 1;
+#endif
+}
+
+#endif // FASTCLOCK_H
@@ -6,27 +6,310 @@
 //        - child handles client communication
 //        - parent continues accepting new clients
 //   5) Uses a SIGCHLD handler to prevent zombie processes
+//
+// Proxy mode:
+//   When backend addresses (host:port) follow the port argument, the server
+//   acts as a layer-4 load balancer instead of answering itself. Each child
+//   connects to a backend picked round-robin by the parent, falling back to
+//   the other backends if it is unreachable, and relays bytes in both
+//   directions with splice(), so payloads never enter userspace.
+//
+// Admission control:
+//   The number of children allowed to handle a request at once adapts to
+//   measured latency. Connections beyond the limit wait in
+//   per-client-address (tenant) queues that are served by deficit round
+//   robin, so one busy client cannot delay everybody else. Sending SIGUSR1
+//   prints the queues.
+//
+// Heavy hitters:
+//   Every accepted connection also updates two fixed-size sketches: a
+//   Space-Saving summary of the busiest client addresses and a HyperLogLog
+//   estimate of how many distinct addresses have connected.
+//
+// Latency:
+//   Children record the time from accept() to reply in a DDSketch kept in
+//   memory shared with the parent. Bucket counts simply add up, so every
+//   child writes into the same sketch and the parent reads the merged
+//   percentiles without collecting anything.
+//
+// Shared-memory statistics:
+//   Latency, counters and gauges live in the POSIX shared memory object
+//   "/fork_server.<port>" (see stats.h), which the monitor tool attaches to.
+//   It includes the resource usage wait4() reports for every reaped child
+//   (CPU time, peak RSS, page faults, context switches), i.e. what one
+//   fork-per-connection child actually costs.
+//
+// Stall watchdog:
+//   Once a child has the client's message, it arms a timer. If producing
+//   and sending the reply takes longer than the stall threshold (-s), the
+//   timer's signal handler dumps the child's stack to stderr and counts a
+//   stall, pointing at whatever blocking call the handler is stuck in.
+//
+// Time:
+//   Timestamps come from fastclock.h (calibrated TSC, vDSO fallback). The
+//   main loop reads the clock once per wakeup into loop_ns, and queueing
+//   and backend health use that cached value.
+
+#define _GNU_SOURCE     // splice(), SPLICE_F_*
 
 #include <stdio.h>      // printf, fprintf, perror
 #include <stdlib.h>     // exit, atoi
-#include <string.h>     // memset / bzero
-#include <unistd.h>     // read, write, close, fork
+#include <string.h>     // memset / bzero, strrchr
+#include <strings.h>    // bzero, bcopy
+#include <unistd.h>     // read, write, close, fork, pipe
+#include <errno.h>      // errno, EINTR, EAGAIN
+#include <fcntl.h>      // splice, fcntl, O_NONBLOCK
+#include <poll.h>       // poll
+#include <math.h>       // sqrt, log
+#include <stdint.h>     // uint8_t, uint32_t, uint64_t
 #include <sys/types.h>  // system data types
-#include <sys/socket.h> // socket, bind, listen, accept
+#include <sys/socket.h> // socket, bind, listen, accept, connect, shutdown
 #include <netinet/in.h> // sockaddr_in, htons, INADDR_ANY
-#include <signal.h>     // signal, SIGCHLD
-#include <sys/wait.h>   // waitpid
+#include <arpa/inet.h>  // inet_aton, inet_ntoa
+#include <netdb.h>      // gethostbyname, struct hostent
+#include <signal.h>     // signal, sigprocmask, SIGCHLD, SIGUSR1
+#include <sys/wait.h>   // wait4
+#include <sys/resource.h> // struct rusage
+#include <sys/time.h>   // setitimer
+#include <execinfo.h>   // backtrace, backtrace_symbols_fd
+#include <sys/mman.h>   // mmap, shm_open
+#include <sys/stat.h>   // mode constants for shm_open
+
+#include "stats.h"      // struct server_stats, sketch helpers
+#include "fastclock.h"  // fastclock_init, fastclock_ns
+
+#define MAX_CHILDREN       STATS_SLOTS    // children tracked at once
+#define MAX_BACKENDS       16     // backends on the command line (at most 32)
+#define BACKEND_RETRY_NS   5000000000ULL  // how long a failed backend is skipped
+#define RELAY_CHUNK        65536  // max bytes moved per splice() call
+#define EXIT_BACKEND_DOWN  2      // child exit status: no backend reachable
+
+#define LIMIT_INITIAL      32     // concurrency limit before any samples
+#define LIMIT_MIN          4      // the limiter never admits fewer children
+#define LIMIT_SMOOTHING    0.2    // weight of each new limit estimate
+#define RTT_TOLERANCE      1.5    // latency up to 1.5x the baseline is fine
+#define RTT_SHORT_WINDOW   10     // samples averaged for current latency
+#define RTT_LONG_WINDOW    500    // samples averaged for the baseline
+#define ADMIT_GRACE_NS     10000000ULL    // new children count as busy (10 ms)
+
+#define MAX_TENANTS        256    // client addresses with their own queue
+#define OVERFLOW_TENANT    MAX_TENANTS    // shared queue once all are busy
+#define MAX_QUEUED         512    // accepted connections waiting for a child
+#define WAIT_AVG_WEIGHT    0.1    // weight of each queueing delay sample
+
+#define TOPK               16     // busiest clients kept by Space-Saving
+#define HLL_BITS           10     // HyperLogLog uses 2^HLL_BITS registers
+#define HLL_REGISTERS      (1 << HLL_BITS)
+
+#define STALL_DEFAULT_MS   100    // default stall threshold (-s)
+#define STALL_MAX_FRAMES   64     // stack frames captured per stall
+
+// -----------------------------------------------------------------------------
+// Backend pool (proxy mode only):
+// down_since_ns is 0 while the backend is healthy, otherwise the loop time
+// its last connection attempt was reported as failed. Children report the
+// backends they could not reach in their stats->slots entry.
+// -----------------------------------------------------------------------------
+struct backend {
+    const char *name;           // "host:port" as given on the command line
+    struct sockaddr_in addr;    // resolved address
+    uint64_t down_since_ns;     // 0 = healthy
+};
+
+static struct backend backends[MAX_BACKENDS];
+static int nbackends;           // 0 = normal (non-proxy) mode
+static int next_backend;        // round-robin cursor
+
+// -----------------------------------------------------------------------------
+// Child table:
+// One slot per running child so the parent can tell which backend a child
+// was using when it exits. pid == 0 marks a free slot. SigCatcher() only
+// records the exit status; the main loop (with SIGCHLD blocked) consumes it.
+// -----------------------------------------------------------------------------
+struct child {
+    pid_t pid;
+    int backend;                // index into backends[], -1 if none
+    volatile sig_atomic_t exited;
+    int status;                 // wait4() status, valid once exited
+    uint64_t start_ns;          // fork time
+    struct rusage usage;        // wait4() resource usage, valid once exited
+};
+
+static struct child children[MAX_CHILDREN];
+
+// Time of the latest main loop wakeup, see fastclock.h
+static uint64_t loop_ns;
+
+// -----------------------------------------------------------------------------
+// Adaptive concurrency limiter (gradient style):
+// Every child that answered a request contributes one latency sample: the
+// time from accept() to the reply being written, minus the time spent
+// waiting for the client's message. It covers the tenant queue, fork() and
+// the handling itself, i.e. all the delay the server adds. Two moving
+// averages are kept: a short one (current latency) and a long one (the
+// no-load baseline). While current latency stays within RTT_TOLERANCE
+// of the baseline the limit grows by about sqrt(limit); when children take
+// longer because they queue for CPU or I/O, the limit shrinks in proportion
+// to baseline / latency. The limit is only changed while at least half of
+// it is in use: at lower load the samples only refine the averages, since
+// they say nothing about how the server behaves at the limit.
+//
+// The limit applies to children handling a request. A child still waiting
+// for its client's message costs nothing, so after ADMIT_GRACE_NS (enough
+// time for a request that was already sent to arrive) it stops counting;
+// MAX_CHILDREN still caps the total.
+// -----------------------------------------------------------------------------
+static double conc_limit = LIMIT_INITIAL;
+static double short_rtt;        // seconds, 0 = no samples yet
+static double long_rtt;         // seconds
+
+// -----------------------------------------------------------------------------
+// Tenant queues:
+// Accepted connections wait in pending[] until the limiter lets a child run.
+// Each client address (tenant) has its own FIFO, linked through
+// pending[].next. Tenants are served by deficit round robin: on each visit
+// a tenant earns 'weight' credits and every connection dispatched costs
+// one, so with weights 3 and 1 a busy tenant gets three children for every
+// one the other gets, however many connections it has queued.
+// Addresses that arrive while all MAX_TENANTS queues are busy share one
+// extra tenant, OVERFLOW_TENANT (weight 1), reported as "overflow".
+// -----------------------------------------------------------------------------
+struct pending {
+    int fd;                     // accepted socket, -1 = free entry
+    int next;                   // next entry in the tenant FIFO, -1 = last
+    uint64_t queued_ns;         // accept time (loop time)
+};
+
+struct tenant {
+    int in_use;
+    struct in_addr addr;        // client address
+    int weight;                 // DRR quantum (connections per round)
+    int deficit;                // DRR credits left in the current round
+    int head, tail;             // FIFO of pending[] indices, -1 = empty
+    int depth;                  // connections currently queued
+    long served;                // connections dispatched so far
+    double wait_avg;            // moving average of queueing delay (seconds)
+};
+
+// A weight given with -w addr=weight
+struct tenant_weight {
+    struct in_addr addr;
+    int weight;
+};
+
+static struct pending pending[MAX_QUEUED];
+static int nqueued;
+
+// Set when accept() ran out of descriptors (EMFILE/ENFILE). The listener is
+// not polled again until a descriptor is released, otherwise ppoll() would
+// keep reporting the same pending connection and the loop would spin.
+static int accept_paused;
+
+static struct tenant tenants[MAX_TENANTS + 1];  // + OVERFLOW_TENANT
+static int drr_cursor;          // tenant being served
+static int drr_fresh = 1;       // 1 = cursor tenant has not got its quantum
+
+static struct tenant_weight weights[MAX_TENANTS];
+static int nweights;
+
+static volatile sig_atomic_t report_requested;  // set by SIGUSR1
+
+// -----------------------------------------------------------------------------
+// Client sketches:
+// Space-Saving keeps TOPK (address, count) pairs. An address not in the
+// table replaces the one with the smallest count and inherits that count,
+// so each count over-estimates by at most 'error'; any address with more
+// than total/TOPK connections is guaranteed to be listed.
+// HyperLogLog estimates distinct addresses from the longest run of leading
+// zero bits seen in each register (about 3% error with 1024 registers).
+// -----------------------------------------------------------------------------
+struct heavy_hitter {
+    struct in_addr addr;
+    long count;                 // upper bound on the true count
+    long error;                 // count inherited from the evicted entry
+};
+
+static struct heavy_hitter topk[TOPK];
+static int ntopk;
+static long total_accepted;
+static uint8_t hll[HLL_REGISTERS];
+
+// -----------------------------------------------------------------------------
+// Statistics region (layout in stats.h):
+// Mapped MAP_SHARED before the first fork(), so the parent, every child and
+// the monitor tool see the same memory. Children only use atomic adds.
+// The parent removes the object when it exits (error() or SIGTERM/SIGINT),
+// so a monitor never mistakes a dead server's region for a live one.
+// -----------------------------------------------------------------------------
+static struct server_stats *stats;
+static struct child_slot *my_slot;  // child: its own entry in stats->slots
+static char stats_shm_name[64];     // "/fork_server.<port>"
+static pid_t stats_owner;           // parent pid, 0 until the region exists
+
+static volatile sig_atomic_t terminate_requested;   // set by SIGTERM/SIGINT
+
+// -----------------------------------------------------------------------------
+// Stall watchdog:
+// The frame buffer is allocated up front because the stack is captured
+// inside a signal handler, where malloc() is not safe.
+// -----------------------------------------------------------------------------
+static int stall_ms = STALL_DEFAULT_MS;     // 0 = watchdog disabled
+static void *stall_frames[STALL_MAX_FRAMES];
 
 // -----------------------------------------------------------------------------
 // Error handling function:
 // Prints an error message (based on errno) and terminates the program.
+// In the parent it also removes the statistics region; children share it
+// and must leave it in place.
 // -----------------------------------------------------------------------------
 void error(const char *msg)
 {
     perror(msg);
+    if (stats_owner != 0 && getpid() == stats_owner)
+        shm_unlink(stats_shm_name);
     exit(1);
 }
 
+// -----------------------------------------------------------------------------
+// Reply sent to every client:
+// Laid out once at compile time, with its length known in advance, so
+// dostuff() sends it straight from read-only data with a single write().
+// -----------------------------------------------------------------------------
+static const char reply[] = "I got your message";
+
+// -----------------------------------------------------------------------------
+// StallCatcher():
+// SIGALRM handler, runs in a CHILD whose handler exceeded the threshold.
+// Only async-signal-safe calls: write(), backtrace() (pre-loaded in main)
+// and backtrace_symbols_fd(), which writes without allocating.
+// -----------------------------------------------------------------------------
+void StallCatcher(int signo)
+{
+    static const char msg[] = "stall: handler exceeded threshold, stack:\n";
+    int saved_errno = errno;
+    int n;
+
+    (void)signo;
+
+    n = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    n = backtrace(stall_frames, STALL_MAX_FRAMES);
+    backtrace_symbols_fd(stall_frames, n, STDERR_FILENO);
+    __atomic_fetch_add(&stats->stalls, 1, __ATOMIC_RELAXED);
+
+    errno = saved_errno;
+}
+
+// Arms (ms > 0) or disarms (ms == 0) the one-shot stall timer
+static void stall_timer(int ms)
+{
+    struct itimerval it;
+
+    memset(&it, 0, sizeof(it));
+    it.it_value.tv_sec = ms / 1000;
+    it.it_value.tv_usec = (ms % 1000) * 1000;
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
 // -----------------------------------------------------------------------------
 // dostuff():
 // Handles communication with a SINGLE client.
@@ -36,26 +319,667 @@ void error(const char *msg)
 //   1) Read data sent by the client
 //   2) Print the received message
 //   3) Send a response back to the client
+//
+// Waiting for the client's message is normal; everything after it runs
+// under the stall watchdog. The request's latency, without that wait, is
+// reported to the parent through the child's slot.
 // -----------------------------------------------------------------------------
 void dostuff(int sockfd)
 {
     char buffer[256];
+    uint64_t read_start, handle_start;
     int n;
 
     // Clear buffer to avoid leftover data
     bzero(buffer, sizeof(buffer));
 
     // Read message from client
+    read_start = fastclock_ns();
     n = read(sockfd, buffer, sizeof(buffer) - 1);
     if (n < 0)
         error("ERROR reading from socket");
+    __atomic_fetch_add(&stats->bytes_in, n, __ATOMIC_RELAXED);
+
+    handle_start = fastclock_ns();
+    __atomic_store_n(&my_slot->state, SLOT_HANDLING, __ATOMIC_RELAXED);
+
+    if (stall_ms > 0)
+        stall_timer(stall_ms);
 
     printf("Message from client: %s\n", buffer);
 
     // Send response to client
-    n = write(sockfd, "I got your message", 18);
+    n = write(sockfd, reply, sizeof(reply) - 1);
     if (n < 0)
         error("ERROR writing to socket");
+    __atomic_fetch_add(&stats->bytes_out, n, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->requests, 1, __ATOMIC_RELAXED);
+
+    my_slot->latency_ns = fastclock_ns() - my_slot->accepted_ns -
+                          (handle_start - read_start);
+    __atomic_store_n(&my_slot->state, SLOT_DONE, __ATOMIC_RELEASE);
+
+    if (stall_ms > 0)
+        stall_timer(0);
+}
+
+// -----------------------------------------------------------------------------
+// splice_once():
+// Moves whatever is currently readable on 'from' to 'to' through the pipe,
+// without copying the payload into userspace:
+//   from --splice--> pipe --splice--> to
+//
+// Returns the number of bytes moved, 0 on end-of-stream and -1 if the
+// destination can no longer be written. Moved bytes are added to *counter.
+// -----------------------------------------------------------------------------
+static ssize_t splice_once(int from, int pipefd[2], int to, uint64_t *counter)
+{
+    ssize_t n, m, left;
+
+    n = splice(from, NULL, pipefd[1], NULL, RELAY_CHUNK,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return 1;           // spurious wakeup, nothing moved
+        return 0;               // e.g. ECONNRESET: treat as end-of-stream
+    }
+
+    // Drain the pipe completely so it is empty before the next read
+    for (left = n; left > 0; left -= m) {
+        m = splice(pipefd[0], NULL, to, NULL, left, SPLICE_F_MOVE);
+        if (m <= 0)
+            return -1;
+    }
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+    return n;
+}
+
+// -----------------------------------------------------------------------------
+// relay():
+// Copies bytes client -> backend and backend -> client until both sides
+// have closed. When one side reaches end-of-stream, its peer's write half is
+// shut down so half-closed connections behave as they would end-to-end.
+// -----------------------------------------------------------------------------
+static void relay(int clientfd, int backendfd)
+{
+    int pipes[2][2];            // [0]: client -> backend, [1]: backend -> client
+    int peer[2] = { backendfd, clientfd };
+    uint64_t *counter[2] = { &stats->bytes_in, &stats->bytes_out };
+    struct pollfd fds[2];
+    int open = 2;
+    int i;
+
+    if (pipe(pipes[0]) < 0 || pipe(pipes[1]) < 0)
+        error("ERROR creating pipe");
+
+    fds[0].fd = clientfd;
+    fds[1].fd = backendfd;
+    fds[0].events = fds[1].events = POLLIN;
+
+    while (open > 0) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            error("ERROR on poll");
+        }
+
+        for (i = 0; i < 2; i++) {
+            ssize_t n;
+
+            if (fds[i].fd < 0 || fds[i].revents == 0)
+                continue;
+
+            n = splice_once(fds[i].fd, pipes[i], peer[i], counter[i]);
+            if (n < 0)
+                return;         // peer is gone, nothing left to relay
+
+            if (n == 0) {
+                shutdown(peer[i], SHUT_WR);
+                fds[i].fd = -1; // poll() ignores negative descriptors
+                open--;
+            }
+        }
+    }
+}
+
+// Opens a connection to one backend, returning the socket or -1
+static int connect_backend(const struct backend *be)
+{
+    int backendfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (backendfd < 0)
+        error("ERROR opening socket");
+
+    if (connect(backendfd, (const struct sockaddr *)&be->addr,
+                sizeof(be->addr)) < 0) {
+        fprintf(stderr, "backend %s unreachable\n", be->name);
+        close(backendfd);
+        return -1;
+    }
+    return backendfd;
+}
+
+// -----------------------------------------------------------------------------
+// doproxy():
+// Proxy-mode counterpart of dostuff(). Runs in the CHILD process.
+// Connects to the backend chosen by the parent and relays the connection.
+// If that backend cannot be reached, the other healthy backends are tried
+// in round-robin order, then the ones marked down. Every failure is noted
+// in the child's slot so the parent can stop sending traffic there for a
+// while; the client is only dropped (exit status EXIT_BACKEND_DOWN) when
+// no backend answers.
+// -----------------------------------------------------------------------------
+void doproxy(int clientfd, int first)
+{
+    int backendfd = -1;
+    int pass, i, b;
+
+    // A peer closing mid-relay must not kill the child with SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+
+    // Pass 0: the parent's pick and the healthy backends; pass 1: the rest
+    for (pass = 0; pass < 2 && backendfd < 0; pass++) {
+        for (i = 0; i < nbackends && backendfd < 0; i++) {
+            b = (first + i) % nbackends;
+            if ((my_slot->failed & (1u << b)) ||
+                (i > 0 && (backends[b].down_since_ns != 0) != pass))
+                continue;
+
+            backendfd = connect_backend(&backends[b]);
+            if (backendfd < 0)
+                my_slot->failed |= 1u << b;
+            else
+                my_slot->backend = b;
+        }
+    }
+    if (backendfd < 0)
+        exit(EXIT_BACKEND_DOWN);
+
+    relay(clientfd, backendfd);
+    close(backendfd);
+}
+
+// -----------------------------------------------------------------------------
+// parse_backend():
+// Resolves a "host:port" argument into a backend entry.
+// -----------------------------------------------------------------------------
+static void parse_backend(struct backend *be, const char *arg)
+{
+    char host[256];
+    const char *colon = strrchr(arg, ':');
+    struct hostent *server;
+    size_t len;
+
+    if (colon == NULL || (len = colon - arg) >= sizeof(host)) {
+        fprintf(stderr, "ERROR, backend must be host:port: %s\n", arg);
+        exit(1);
+    }
+    memcpy(host, arg, len);
+    host[len] = '\0';
+
+    server = gethostbyname(host);
+    if (server == NULL) {
+        fprintf(stderr, "ERROR, no such host: %s\n", host);
+        exit(1);
+    }
+
+    be->name = arg;
+    bzero((char *)&be->addr, sizeof(be->addr));
+    be->addr.sin_family = AF_INET;
+    bcopy((char *)server->h_addr, (char *)&be->addr.sin_addr.s_addr,
+          server->h_length);
+    be->addr.sin_port = htons(atoi(colon + 1));
+    be->down_since_ns = 0;
+}
+
+// -----------------------------------------------------------------------------
+// pick_backend():
+// Round-robin over healthy backends. A backend marked down is skipped until
+// BACKEND_RETRY_NS have passed, after which it gets one trial connection.
+// If every backend is down, plain round-robin is used as a last resort.
+// -----------------------------------------------------------------------------
+static int pick_backend(void)
+{
+    int i, b;
+
+    for (i = 0; i < nbackends; i++) {
+        b = (next_backend + i) % nbackends;
+        if (backends[b].down_since_ns == 0 ||
+            loop_ns - backends[b].down_since_ns >= BACKEND_RETRY_NS) {
+            next_backend = (b + 1) % nbackends;
+            return b;
+        }
+    }
+
+    b = next_backend;
+    next_backend = (b + 1) % nbackends;
+    return b;
+}
+
+// Seconds between two fastclock_ns() timestamps
+static double elapsed(uint64_t from_ns, uint64_t to_ns)
+{
+    return (to_ns - from_ns) / 1e9;
+}
+
+// -----------------------------------------------------------------------------
+// limiter_update():
+// Feeds one latency sample (seconds) into the concurrency limit.
+// 'busy' is the number of children handling a request when the sample
+// arrived; the limit is left alone (in both directions) while less than
+// half of it is in use.
+// -----------------------------------------------------------------------------
+static void limiter_update(double rtt, int busy)
+{
+    double gradient, estimate;
+
+    if (short_rtt == 0)
+        short_rtt = long_rtt = rtt;
+    short_rtt += (rtt - short_rtt) / RTT_SHORT_WINDOW;
+    long_rtt += (rtt - long_rtt) / RTT_LONG_WINDOW;
+
+    // After a load spike the baseline would take RTT_LONG_WINDOW samples to
+    // come back down; pull it faster once latency is clearly lower again.
+    if (long_rtt > 2 * short_rtt)
+        long_rtt *= 0.95;
+
+    gradient = RTT_TOLERANCE * long_rtt / short_rtt;
+    if (gradient > 1.0)
+        gradient = 1.0;
+    if (gradient < 0.5)
+        gradient = 0.5;
+
+    if (busy * 2 < conc_limit)
+        return;
+
+    estimate = conc_limit * gradient + sqrt(conc_limit);
+
+    conc_limit = (1 - LIMIT_SMOOTHING) * conc_limit + LIMIT_SMOOTHING * estimate;
+    if (conc_limit < LIMIT_MIN)
+        conc_limit = LIMIT_MIN;
+    if (conc_limit > MAX_CHILDREN)
+        conc_limit = MAX_CHILDREN;
+}
+
+// -----------------------------------------------------------------------------
+// account_usage():
+// Adds one reaped child's resource usage to the shared histograms.
+// -----------------------------------------------------------------------------
+static void account_usage(const struct rusage *ru)
+{
+    struct child_usage *u = &stats->usage;
+
+    hist_add(&u->cpu_us, ru->ru_utime.tv_sec * 1000000ULL + ru->ru_utime.tv_usec +
+                         ru->ru_stime.tv_sec * 1000000ULL + ru->ru_stime.tv_usec);
+    hist_add(&u->maxrss_kb, ru->ru_maxrss);
+    hist_add(&u->faults, ru->ru_minflt + ru->ru_majflt);
+    hist_add(&u->ctx_switches, ru->ru_nvcsw + ru->ru_nivcsw);
+    u->reaped++;
+}
+
+// -----------------------------------------------------------------------------
+// collect_children():
+// Frees the table slots of children reaped by SigCatcher() and updates
+// backend health and the concurrency limit from them. Must run with SIGCHLD
+// blocked. Returns the number of children still running and stores in
+// *busy how many of them count against the concurrency limit.
+// -----------------------------------------------------------------------------
+static int collect_children(int *busy)
+{
+    int i, b, running = 0;
+
+    *busy = 0;
+    for (i = 0; i < MAX_CHILDREN; i++) {
+        const struct child *c = &children[i];
+        uint32_t state;
+
+        if (c->pid == 0 || c->exited)
+            continue;
+        running++;
+
+        // Freshly forked children count until their message had time to
+        // arrive; after that, only the ones actually handling one.
+        state = __atomic_load_n(&stats->slots[i].state, __ATOMIC_RELAXED);
+        if (state == SLOT_HANDLING ||
+            (state == SLOT_WAITING && c->start_ns + ADMIT_GRACE_NS > loop_ns))
+            (*busy)++;
+    }
+
+    for (i = 0; i < MAX_CHILDREN; i++) {
+        struct child *c = &children[i];
+        const struct child_slot *cs = &stats->slots[i];
+
+        if (c->pid == 0 || !c->exited)
+            continue;
+
+        // Only children that answered a request are sampled: proxy children
+        // live as long as the relayed session, and a child whose client
+        // never sent anything says nothing about server load.
+        if (c->backend < 0 && cs->state == SLOT_DONE)
+            limiter_update(cs->latency_ns / 1e9, *busy);
+
+        // Backends the child could not reach are down; the one it relayed
+        // to is healthy again
+        if (c->backend >= 0) {
+            for (b = 0; b < nbackends; b++)
+                if (cs->failed & (1u << b))
+                    backends[b].down_since_ns = loop_ns;
+            if (cs->backend >= 0)
+                backends[cs->backend].down_since_ns = 0;
+        }
+
+        account_usage(&c->usage);
+
+        c->pid = 0;
+        c->exited = 0;
+        accept_paused = 0;
+    }
+    return running;
+}
+
+static struct child *free_child_slot(void)
+{
+    int i;
+
+    for (i = 0; i < MAX_CHILDREN; i++)
+        if (children[i].pid == 0)
+            return &children[i];
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------
+// find_tenant():
+// Returns the tenant for a client address, creating it if needed. When the
+// table is full, an idle tenant (empty queue) is recycled; if every tenant
+// has queued connections, the address goes to the shared overflow tenant
+// rather than borrowing another address's queue, weight and metrics.
+// -----------------------------------------------------------------------------
+static struct tenant *find_tenant(struct in_addr addr)
+{
+    struct tenant *t = NULL;
+    int i;
+
+    for (i = 0; i < MAX_TENANTS; i++)
+        if (tenants[i].in_use && tenants[i].addr.s_addr == addr.s_addr)
+            return &tenants[i];
+
+    for (i = 0; i < MAX_TENANTS && t == NULL; i++)
+        if (!tenants[i].in_use)
+            t = &tenants[i];
+    for (i = 0; i < MAX_TENANTS && t == NULL; i++)
+        if (tenants[i].depth == 0)
+            t = &tenants[i];
+    if (t == NULL) {
+        t = &tenants[OVERFLOW_TENANT];
+        if (!t->in_use) {
+            t->in_use = 1;
+            t->weight = 1;
+            t->head = t->tail = -1;
+        }
+        return t;
+    }
+
+    memset(t, 0, sizeof(*t));
+    t->in_use = 1;
+    t->addr = addr;
+    t->weight = 1;
+    t->head = t->tail = -1;
+    for (i = 0; i < nweights; i++)
+        if (weights[i].addr.s_addr == addr.s_addr)
+            t->weight = weights[i].weight;
+    return t;
+}
+
+// Adds an accepted connection to its tenant's queue (needs nqueued < MAX_QUEUED)
+static void enqueue(int fd, struct in_addr addr)
+{
+    struct tenant *t = find_tenant(addr);
+    int i;
+
+    for (i = 0; pending[i].fd >= 0; i++)
+        ;
+    pending[i].fd = fd;
+    pending[i].next = -1;
+    pending[i].queued_ns = loop_ns;
+
+    if (t->tail >= 0)
+        pending[t->tail].next = i;
+    else
+        t->head = i;
+    t->tail = i;
+    t->depth++;
+    nqueued++;
+}
+
+// -----------------------------------------------------------------------------
+// dequeue():
+// Deficit round robin: picks the next queued connection, removes it from
+// its tenant's queue and returns its socket (-1 if nothing is queued).
+// The connection's accept time is stored in *accepted_ns.
+// -----------------------------------------------------------------------------
+static int dequeue(uint64_t *accepted_ns)
+{
+    if (nqueued == 0)
+        return -1;
+
+    for (;;) {
+        struct tenant *t = &tenants[drr_cursor];
+
+        if (t->depth > 0 && drr_fresh) {
+            t->deficit += t->weight;
+            drr_fresh = 0;
+        }
+
+        if (t->depth > 0 && t->deficit >= 1) {
+            struct pending *p = &pending[t->head];
+            int fd = p->fd;
+
+            *accepted_ns = p->queued_ns;
+
+            t->deficit--;
+            t->head = p->next;
+            if (--t->depth == 0) {
+                t->tail = -1;
+                t->deficit = 0;     // idle tenants do not bank credits
+            }
+            t->served++;
+
+            t->wait_avg += WAIT_AVG_WEIGHT *
+                           (elapsed(p->queued_ns, loop_ns) - t->wait_avg);
+
+            p->fd = -1;
+            nqueued--;
+            return fd;
+        }
+
+        drr_cursor = (drr_cursor + 1) % (MAX_TENANTS + 1);
+        drr_fresh = 1;
+    }
+}
+
+// SplitMix64 finalizer: spreads an address over 64 well-mixed bits
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// -----------------------------------------------------------------------------
+// sketch_update():
+// Counts one accepted connection from 'addr' in both sketches.
+// -----------------------------------------------------------------------------
+static void sketch_update(struct in_addr addr)
+{
+    uint64_t h = mix64(addr.s_addr);
+    uint64_t rest = h << HLL_BITS;
+    int rank, i, min = 0;
+
+    total_accepted++;
+
+    // HyperLogLog: top HLL_BITS pick the register, the rest give the rank
+    rank = rest == 0 ? 64 - HLL_BITS + 1 : __builtin_clzll(rest) + 1;
+    if (rank > hll[h >> (64 - HLL_BITS)])
+        hll[h >> (64 - HLL_BITS)] = rank;
+
+    // Space-Saving
+    for (i = 0; i < ntopk; i++) {
+        if (topk[i].addr.s_addr == addr.s_addr) {
+            topk[i].count++;
+            return;
+        }
+        if (topk[i].count < topk[min].count)
+            min = i;
+    }
+    if (ntopk < TOPK) {
+        topk[ntopk].addr = addr;
+        topk[ntopk].count = 1;
+        topk[ntopk++].error = 0;
+        return;
+    }
+    topk[min].addr = addr;
+    topk[min].error = topk[min].count;
+    topk[min].count++;
+}
+
+// HyperLogLog estimate, with linear counting for small cardinalities
+static double unique_clients(void)
+{
+    double sum = 0, m = HLL_REGISTERS;
+    double estimate;
+    int i, zeros = 0;
+
+    for (i = 0; i < HLL_REGISTERS; i++) {
+        sum += ldexp(1.0, -hll[i]);
+        if (hll[i] == 0)
+            zeros++;
+    }
+
+    estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0)
+        estimate = m * log(m / zeros);
+    return estimate;
+}
+
+static int cmp_hitters(const void *a, const void *b)
+{
+    long x = ((const struct heavy_hitter *)a)->count;
+    long y = ((const struct heavy_hitter *)b)->count;
+
+    return (y > x) - (y < x);
+}
+
+// Adds one latency sample (seconds) to the shared sketch. Runs in children.
+static void latency_record(double seconds)
+{
+    double gamma = (1 + SKETCH_ALPHA) / (1 - SKETCH_ALPHA);
+    double us = seconds * 1e6;
+    int i = us <= 1 ? 0 : (int)ceil(log(us) / log(gamma));
+
+    if (i >= SKETCH_BUCKETS)
+        i = SKETCH_BUCKETS - 1;
+    __atomic_fetch_add(&stats->latency.buckets[i], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->latency.count, 1, __ATOMIC_RELAXED);
+}
+
+// -----------------------------------------------------------------------------
+// parse_weight():
+// Parses a "-w addr=weight" option.
+// -----------------------------------------------------------------------------
+static void parse_weight(const char *arg)
+{
+    char addr[64];
+    const char *eq = strchr(arg, '=');
+    size_t len;
+
+    if (nweights == MAX_TENANTS) {
+        fprintf(stderr, "ERROR, at most %d weights\n", MAX_TENANTS);
+        exit(1);
+    }
+    if (eq == NULL || (len = eq - arg) >= sizeof(addr)) {
+        fprintf(stderr, "ERROR, weight must be addr=weight: %s\n", arg);
+        exit(1);
+    }
+    memcpy(addr, arg, len);
+    addr[len] = '\0';
+
+    if (inet_aton(addr, &weights[nweights].addr) == 0 || atoi(eq + 1) < 1) {
+        fprintf(stderr, "ERROR, bad weight: %s\n", arg);
+        exit(1);
+    }
+    weights[nweights++].weight = atoi(eq + 1);
+}
+
+// One line of the per-child resource usage report
+static void report_usage(const char *what, const char *unit,
+                         const struct rusage_hist *h)
+{
+    uint64_t n = stats->usage.reaped;
+
+    fprintf(stderr, "child %-12s mean %.1f p50 <= %lu p99 <= %lu %s\n", what,
+            n ? (double)h->total / n : 0.0,
+            (unsigned long)hist_quantile(h, NULL, 0.5),
+            (unsigned long)hist_quantile(h, NULL, 0.99), unit);
+}
+
+// -----------------------------------------------------------------------------
+// report_stats():
+// Prints the admission state and every tenant queue to stderr.
+// Triggered by SIGUSR1 (kill -USR1 <pid>).
+// -----------------------------------------------------------------------------
+static void report_stats(int running, int busy)
+{
+    int i;
+
+    fprintf(stderr, "running %d busy %d limit %.1f queued %d\n",
+            running, busy, conc_limit, nqueued);
+    for (i = 0; i <= OVERFLOW_TENANT; i++) {
+        const struct tenant *t = &tenants[i];
+
+        if (!t->in_use)
+            continue;
+        fprintf(stderr, "  tenant %-15s weight %d queued %d served %ld "
+                "wait %.3f ms\n",
+                i == OVERFLOW_TENANT ? "overflow" : inet_ntoa(t->addr),
+                t->weight, t->depth, t->served, t->wait_avg * 1e3);
+    }
+
+    fprintf(stderr, "accepted %ld unique clients ~%.0f\n",
+            total_accepted, unique_clients());
+    qsort(topk, ntopk, sizeof(topk[0]), cmp_hitters);
+    for (i = 0; i < ntopk; i++)
+        fprintf(stderr, "  top %-15s %ld connections (overcount <= %ld)\n",
+                inet_ntoa(topk[i].addr), topk[i].count, topk[i].error);
+
+    fprintf(stderr, "latency p50 %.0f us p90 %.0f us p99 %.0f us "
+            "p99.9 %.0f us (%lu requests)\n",
+            sketch_quantile(&stats->latency, NULL, 0.5),
+            sketch_quantile(&stats->latency, NULL, 0.9),
+            sketch_quantile(&stats->latency, NULL, 0.99),
+            sketch_quantile(&stats->latency, NULL, 0.999),
+            (unsigned long)stats->latency.count);
+    fprintf(stderr, "stalls %lu (threshold %d ms)\n",
+            (unsigned long)stats->stalls, stall_ms);
+
+    report_usage("cpu", "us", &stats->usage.cpu_us);
+    report_usage("max rss", "KB", &stats->usage.maxrss_kb);
+    report_usage("page faults", "", &stats->usage.faults);
+    report_usage("ctx switches", "", &stats->usage.ctx_switches);
+}
+
+void ReportCatcher(int signo)
+{
+    (void)signo;
+    report_requested = 1;
+}
+
+void TermCatcher(int signo)
+{
+    (void)signo;
+    terminate_requested = 1;
 }
 
 // -----------------------------------------------------------------------------
@@ -67,15 +991,34 @@ void dostuff(int sockfd)
 //   - Reap finished child processes
 //   - Prevent zombie processes
 //
-// waitpid(-1, NULL, WNOHANG):
+// wait4(-1, &status, WNOHANG, &usage):
 //   - -1     : wait for ANY child process
-//   - NULL   : ignore exit status
+//   - status : exit status, recorded in the child table
 //   - WNOHANG: do not block if no child has exited
+//   - usage  : the child's resource usage, also recorded in the table
 // -----------------------------------------------------------------------------
 void SigCatcher(int signo)
 {
-    while (waitpid(-1, NULL, WNOHANG) > 0)
-        ; // reap all terminated children
+    int saved_errno = errno;    // wait4() may clobber the interrupted errno
+    struct rusage usage;
+    int status, i;
+    pid_t pid;
+
+    (void)signo;
+
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        // reap all terminated children and record how they ended
+        for (i = 0; i < MAX_CHILDREN; i++) {
+            if (children[i].pid == pid) {
+                children[i].status = status;
+                children[i].usage = usage;
+                children[i].exited = 1;
+                break;
+            }
+        }
+    }
+
+    errno = saved_errno;
 }
 
 int main(int argc, char *argv[])
@@ -88,21 +1031,69 @@ int main(int argc, char *argv[])
     struct sockaddr_in serv_addr; // server address
     struct sockaddr_in cli_addr;  // client address
 
+    sigset_t chld_mask;           // SIGCHLD, SIGUSR1, SIGTERM and SIGINT
+    sigset_t orig_mask;           // signal mask to restore while waiting
+    struct pollfd listen_pfd;
+    struct timespec recheck = { 0, ADMIT_GRACE_NS };
+    int shm_fd;
+    int opt, i, n;
+
     // -------------------------------------------------------------------------
     // Install signal handler for SIGCHLD:
     // Ensures terminated child processes are cleaned up properly.
     // -------------------------------------------------------------------------
     signal(SIGCHLD, SigCatcher);
+    signal(SIGUSR1, ReportCatcher);
+    signal(SIGTERM, TermCatcher);
+    signal(SIGINT, TermCatcher);
+
+    // Pick and calibrate the clock before any child is forked
+    fastclock_init();
+
+    // The first backtrace() call loads libgcc (and may allocate); do it now
+    // so the stall handler in the children never has to.
+    backtrace(stall_frames, 1);
+
+    // -------------------------------------------------------------------------
+    // Options:
+    //   -w addr=weight : DRR weight of a client address (default 1)
+    //   -s ms          : stall watchdog threshold (default 100, 0 = off)
+    // -------------------------------------------------------------------------
+    while ((opt = getopt(argc, argv, "w:s:")) != -1) {
+        switch (opt) {
+        case 'w':
+            parse_weight(optarg);
+            break;
+        case 's':
+            stall_ms = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-w addr=weight] [-s stall_ms] "
+                    "port [host:port ...]\n", argv[0]);
+            exit(1);
+        }
+    }
 
     // -------------------------------------------------------------------------
     // Check command-line arguments:
     // The server requires ONE argument: the port number.
     // -------------------------------------------------------------------------
-    if (argc < 2) {
+    if (argc - optind < 1) {
         fprintf(stderr, "ERROR, no port provided\n");
         exit(1);
     }
 
+    // -------------------------------------------------------------------------
+    // Optional backends (proxy mode):
+    //   ./fork_server <port> host:port [host:port ...]
+    // -------------------------------------------------------------------------
+    if (argc - optind - 1 > MAX_BACKENDS) {
+        fprintf(stderr, "ERROR, at most %d backends\n", MAX_BACKENDS);
+        exit(1);
+    }
+    for (i = optind + 1; i < argc; i++)
+        parse_backend(&backends[nbackends++], argv[i]);
+
     // -------------------------------------------------------------------------
     // Create a TCP socket:
     //   AF_INET     : IPv4
@@ -117,7 +1108,7 @@ int main(int argc, char *argv[])
     // Clear all fields to avoid garbage values.
     // -------------------------------------------------------------------------
     bzero((char *)&serv_addr, sizeof(serv_addr));
-    portno = atoi(argv[1]);              // convert port argument to integer
+    portno = atoi(argv[optind]);         // convert port argument to integer
 
     serv_addr.sin_family = AF_INET;      // IPv4
     serv_addr.sin_addr.s_addr = INADDR_ANY;
@@ -133,53 +1124,184 @@ int main(int argc, char *argv[])
 
     // -------------------------------------------------------------------------
     // Listen for incoming connections:
-    // backlog = 5 means up to 5 pending connections can be queued.
+    // backlog = SOMAXCONN lets clients wait in the kernel queue once the
+    // tenant queues are full.
+    // The listening socket is non-blocking so the main loop can drain every
+    // pending connection and then go back to waiting in ppoll().
+    // -------------------------------------------------------------------------
+    listen(sockfd, SOMAXCONN);
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+
+    for (i = 0; i < MAX_QUEUED; i++)
+        pending[i].fd = -1;
+
+    // -------------------------------------------------------------------------
+    // Statistics region:
+    // Shared with every child, so it must exist before the first fork().
+    // O_TRUNC + ftruncate() zero any region left over from an earlier run.
+    // -------------------------------------------------------------------------
+    stats_name(stats_shm_name, sizeof(stats_shm_name), portno);
+    shm_fd = shm_open(stats_shm_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (shm_fd < 0)
+        error("ERROR opening shared memory");
+    stats_owner = getpid();
+    if (ftruncate(shm_fd, sizeof(*stats)) < 0)
+        error("ERROR sizing shared memory");
+    stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED,
+                 shm_fd, 0);
+    if (stats == MAP_FAILED)
+        error("ERROR mapping shared memory");
+    close(shm_fd);
+    stats->pid = getpid();
+    stats->magic = STATS_MAGIC;
+
     // -------------------------------------------------------------------------
-    listen(sockfd, 5);
+    // SIGCHLD, SIGUSR1, SIGTERM and SIGINT stay blocked while the main loop
+    // touches the child table and queues, and are only let through while
+    // waiting in ppoll().
+    // -------------------------------------------------------------------------
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigaddset(&chld_mask, SIGUSR1);
+    sigaddset(&chld_mask, SIGTERM);
+    sigaddset(&chld_mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &chld_mask, &orig_mask);
 
-    clilen = sizeof(cli_addr);
+    listen_pfd.fd = sockfd;
+    loop_ns = fastclock_ns();
 
     // -------------------------------------------------------------------------
     // Main server loop:
-    // Continuously accept and handle incoming client connections.
+    //   1) Start children for queued connections while the limit allows
+    //   2) Wait for a new connection, a child exit or SIGUSR1
+    //   3) Accept every pending connection into its tenant queue
     // -------------------------------------------------------------------------
     while (1) {
+        struct child *slot;
+        int running, busy;
 
-        // accept() blocks until a client connects
-        newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
-        if (newsockfd < 0)
-            error("ERROR on accept");
-
-        // ---------------------------------------------------------------------
-        // fork() creates a new process:
-        //   - return value < 0 : error
-        //   - return value = 0 : child process
-        //   - return value > 0 : parent process
-        // ---------------------------------------------------------------------
-        pid_t pid = fork();
-        if (pid < 0)
-            error("ERROR on fork");
-
-        if (pid == 0) {
-            // ---------------------- Child process ----------------------------
-            // Child does NOT need the listening socket
-            close(sockfd);
-
-            // Handle client communication
-            dostuff(newsockfd);
-
-            // Close client socket after communication is done
-            close(newsockfd);
-
-            // Terminate child process
+        // Shutting down: remove the statistics region, leave the children
+        if (terminate_requested) {
+            shm_unlink(stats_shm_name);
             exit(0);
-        } else {
-            // ---------------------- Parent process ---------------------------
-            // Parent does NOT communicate with the client
-            // Close the connected socket and continue accepting new clients
-            close(newsockfd);
+        }
+
+        // Admission: the concurrency limit caps children handling a
+        // request, MAX_CHILDREN caps all of them
+        running = collect_children(&busy);
+        while (nqueued > 0 && (slot = free_child_slot()) != NULL &&
+               (nbackends > 0 || busy < (int)conc_limit)) {
+            uint64_t accepted_ns;
+            int backend = -1;
+
+            newsockfd = dequeue(&accepted_ns);
+            if (nbackends > 0)
+                backend = pick_backend();
+
+            slot->start_ns = fastclock_ns();
+            stats->slots[slot - children].state = SLOT_WAITING;
+            stats->slots[slot - children].accepted_ns = accepted_ns;
+            stats->slots[slot - children].backend = -1;
+            stats->slots[slot - children].failed = 0;
+
+            // -----------------------------------------------------------------
+            // fork() creates a new process:
+            //   - return value < 0 : error
+            //   - return value = 0 : child process
+            //   - return value > 0 : parent process
+            // -----------------------------------------------------------------
+            pid_t pid = fork();
+            if (pid < 0)
+                error("ERROR on fork");
+
+            if (pid == 0) {
+                // -------------------- Child process --------------------------
+                signal(SIGALRM, StallCatcher);
+                signal(SIGTERM, SIG_DFL);
+                signal(SIGINT, SIG_DFL);
+                sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+                my_slot = &stats->slots[slot - children];
+
+                // Child does NOT need the listening socket, nor the
+                // connections still queued for other children
+                close(sockfd);
+                for (i = 0; i < MAX_QUEUED; i++)
+                    if (pending[i].fd >= 0)
+                        close(pending[i].fd);
+
+                // Handle client communication (or relay it to a backend)
+                if (backend >= 0) {
+                    doproxy(newsockfd, backend);
+                } else {
+                    dostuff(newsockfd);
+                    latency_record(elapsed(accepted_ns, fastclock_ns()));
+                }
+
+                // Close client socket after communication is done
+                close(newsockfd);
+
+                // Terminate child process
+                exit(0);
+            } else {
+                // -------------------- Parent process -------------------------
+                // Parent does NOT communicate with the client
+                // Close the connected socket and continue with the next one
+                slot->pid = pid;
+                slot->backend = backend;
+                running++;
+                busy++;
+                close(newsockfd);
+                accept_paused = 0;
+            }
+        }
+
+        // Publish gauges for the monitor
+        stats->running = running;
+        stats->busy = busy;
+        stats->queued = nqueued;
+        stats->limit = conc_limit;
+
+        if (report_requested) {
+            report_requested = 0;
+            report_stats(running, busy);
+        }
+
+        // Wait; stop polling the listener while the tenant queues are full
+        // or descriptors ran out. Children going idle send no signal, so
+        // while connections are queued, wake up again once the grace period
+        // has run out.
+        listen_pfd.events = nqueued < MAX_QUEUED && !accept_paused ? POLLIN : 0;
+        n = ppoll(&listen_pfd, 1, nqueued > 0 ? &recheck : NULL, &orig_mask);
+        loop_ns = fastclock_ns();
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;   // SIGCHLD, SIGUSR1, SIGTERM or SIGINT
+            error("ERROR on poll");
+        }
+        if (n == 0)
+            continue;       // admission recheck
+
+        // Drain the listen backlog into the tenant queues
+        while (nqueued < MAX_QUEUED) {
+            clilen = sizeof(cli_addr);
+            newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
+            if (newsockfd < 0) {
+                // EMFILE/ENFILE: leave the rest in the kernel backlog until
+                // a dispatched or exiting child frees some descriptors
+                if (errno == EMFILE || errno == ENFILE) {
+                    accept_paused = 1;
+                    break;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == ECONNABORTED || errno == EINTR)
+                    break;
+                error("ERROR on accept");
+            }
+            stats->connections++;
+            sketch_update(cli_addr.sin_addr);
+            enqueue(newsockfd, cli_addr.sin_addr);
         }
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,369 @@
+//   Network impairment proxy for benchmarking over loopback:
+//   1) Listens on a local port
+//   2) For each client connection, fork() a child that connects to the real
+//      server and relays bytes in both directions
+//   3) On the way through, every packet-sized chunk of data is
+//        - serialized at a capped bandwidth       (-b bytes/sec)
+//        - delayed by a one-way latency            (-d ms)
+//        - plus a random jitter                    (-j ms)
+//        - and, with some probability, "lost"      (-l percent)
+//   4) Uses a SIGCHLD handler to prevent zombie processes
+//
+//   TCP never loses data, so loss is emulated the way the application sees
+//   it: a lost segment shows up one retransmission timeout late, and since
+//   chunks are released in order, everything behind it waits too
+//   (head-of-line blocking).
+//
+//   Example: 40 ms RTT, 10 Mbit/s, 1% loss in front of a server on 5000:
+//     ./impair_proxy -d 20 -j 2 -b 1250000 -l 1 6000 localhost 5000
+//     ./client localhost 6000
+
+#include <stdio.h>      // printf, fprintf, perror
+#include <stdlib.h>     // exit, atoi, malloc, free, drand48
+#include <string.h>     // memcpy
+#include <strings.h>    // bzero, bcopy
+#include <unistd.h>     // read, write, close, fork, getopt
+#include <errno.h>      // errno, EINTR, EAGAIN
+#include <fcntl.h>      // fcntl, O_NONBLOCK
+#include <poll.h>       // poll
+#include <sys/types.h>  // system data types
+#include <sys/socket.h> // socket, bind, listen, accept, connect, shutdown
+#include <netinet/in.h> // sockaddr_in, htons, INADDR_ANY
+#include <netdb.h>      // gethostbyname, struct hostent
+#include <signal.h>     // signal, SIGCHLD, SIGPIPE
+#include <sys/wait.h>   // waitpid
+
+#include "fastclock.h"  // fastclock_init, fastclock_ns
+
+#define PACKET_SIZE     1448        // bytes per emulated segment (Ethernet MSS)
+#define READ_SIZE       65536       // max bytes read from a socket at once
+#define MAX_BUFFERED    (1 << 20)   // per direction; stop reading beyond this
+#define MIN_RTO_NS      200000000ULL // Linux minimum retransmission timeout
+
+// -----------------------------------------------------------------------------
+// Impairment settings (command-line options)
+// -----------------------------------------------------------------------------
+static uint64_t delay_ns;           // -d: one-way latency
+static uint64_t jitter_ns;          // -j: extra random latency, 0..jitter
+static uint64_t bandwidth;          // -b: bytes per second, 0 = unlimited
+static double loss;                 // -l: probability a segment is "lost"
+
+// -----------------------------------------------------------------------------
+// One emulated segment waiting to be delivered
+// -----------------------------------------------------------------------------
+struct chunk {
+    struct chunk *next;
+    uint64_t release_ns;            // earliest time it may be written
+    size_t len, off;                // bytes in data[], bytes already written
+    char data[PACKET_SIZE];
+};
+
+// -----------------------------------------------------------------------------
+// One direction of the relay (client -> server or server -> client)
+// -----------------------------------------------------------------------------
+struct direction {
+    int from, to;
+    struct chunk *head, *tail;      // FIFO of segments in flight
+    size_t buffered;                // bytes in the FIFO
+    uint64_t link_free_ns;          // when the emulated link is idle again
+    uint64_t last_release_ns;       // keeps delivery in order despite jitter
+    int eof;                        // 'from' reached end-of-stream
+    int closed;                     // write half of 'to' already shut down
+};
+
+// Print an error message (based on errno) and terminate the program.
+static void error(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+// -----------------------------------------------------------------------------
+// SigCatcher():
+// Reaps terminated children so they do not become zombies.
+// -----------------------------------------------------------------------------
+static void SigCatcher(int signo)
+{
+    int saved_errno = errno;
+
+    (void)signo;
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+        ; // reap all terminated children
+    errno = saved_errno;
+}
+
+// -----------------------------------------------------------------------------
+// schedule():
+// Splits freshly read bytes into segments and decides when each one is
+// delivered: after its serialization time on the capped link, plus latency
+// and jitter, plus one retransmission timeout if it is "lost".
+// -----------------------------------------------------------------------------
+static void schedule(struct direction *d, const char *buf, size_t len)
+{
+    uint64_t now = fastclock_ns();
+    uint64_t rto = 2 * (delay_ns + jitter_ns);
+
+    if (rto < MIN_RTO_NS)
+        rto = MIN_RTO_NS;
+
+    while (len > 0) {
+        struct chunk *c = malloc(sizeof(*c));
+        uint64_t release;
+
+        if (c == NULL)
+            error("ERROR allocating buffer");
+
+        c->next = NULL;
+        c->off = 0;
+        c->len = len < PACKET_SIZE ? len : PACKET_SIZE;
+        memcpy(c->data, buf, c->len);
+        buf += c->len;
+        len -= c->len;
+
+        // Serialization: the link sends one segment at a time
+        if (d->link_free_ns < now)
+            d->link_free_ns = now;
+        if (bandwidth > 0)
+            d->link_free_ns += c->len * 1000000000ULL / bandwidth;
+
+        release = d->link_free_ns + delay_ns;
+        if (jitter_ns > 0)
+            release += (uint64_t)(drand48() * jitter_ns);
+        if (loss > 0 && drand48() < loss)
+            release += rto;
+
+        // TCP delivers in order: a late segment holds back the ones behind it
+        if (release < d->last_release_ns)
+            release = d->last_release_ns;
+        d->last_release_ns = release;
+        c->release_ns = release;
+
+        if (d->tail)
+            d->tail->next = c;
+        else
+            d->head = c;
+        d->tail = c;
+        d->buffered += c->len;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// deliver():
+// Writes every segment whose release time has come. Returns -1 if the
+// destination is gone.
+// -----------------------------------------------------------------------------
+static int deliver(struct direction *d)
+{
+    uint64_t now = fastclock_ns();
+
+    while (d->head && d->head->release_ns <= now) {
+        struct chunk *c = d->head;
+        ssize_t n = write(d->to, c->data + c->off, c->len - c->off);
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return 0;   // socket buffer full, retry on POLLOUT
+            return -1;
+        }
+
+        c->off += n;
+        if (c->off < c->len)
+            return 0;
+
+        d->head = c->next;
+        if (d->head == NULL)
+            d->tail = NULL;
+        d->buffered -= c->len;
+        free(c);
+    }
+
+    // Pass end-of-stream on once everything before it has been delivered
+    if (d->eof && d->head == NULL && !d->closed) {
+        shutdown(d->to, SHUT_WR);
+        d->closed = 1;
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// relay():
+// Runs in the CHILD process. Moves data both ways through the impairments
+// until both directions have been closed.
+// -----------------------------------------------------------------------------
+static void relay(int clientfd, int serverfd)
+{
+    struct direction dirs[2];
+    char buf[READ_SIZE];
+    int i;
+
+    memset(dirs, 0, sizeof(dirs));
+    dirs[0].from = clientfd;
+    dirs[0].to = serverfd;
+    dirs[1].from = serverfd;
+    dirs[1].to = clientfd;
+
+    fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) | O_NONBLOCK);
+    fcntl(serverfd, F_SETFL, fcntl(serverfd, F_GETFL) | O_NONBLOCK);
+
+    while (!dirs[0].closed || !dirs[1].closed) {
+        struct pollfd fds[4];
+        uint64_t now = fastclock_ns();
+        int timeout = -1;
+
+        // fds[2*i]: read side of direction i, fds[2*i+1]: its write side
+        for (i = 0; i < 2; i++) {
+            struct direction *d = &dirs[i];
+
+            fds[2 * i].fd = (!d->eof && d->buffered < MAX_BUFFERED) ? d->from : -1;
+            fds[2 * i].events = POLLIN;
+            fds[2 * i + 1].fd = -1;
+            fds[2 * i + 1].events = POLLOUT;
+
+            if (d->head == NULL)
+                continue;
+            if (d->head->release_ns <= now) {
+                fds[2 * i + 1].fd = d->to;      // due now: wait for room
+            } else {
+                uint64_t wait_ms = (d->head->release_ns - now + 999999) / 1000000;
+
+                if (timeout < 0 || (int)wait_ms < timeout)
+                    timeout = (int)wait_ms;
+            }
+        }
+
+        if (poll(fds, 4, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            error("ERROR on poll");
+        }
+
+        for (i = 0; i < 2; i++) {
+            struct direction *d = &dirs[i];
+
+            if (fds[2 * i].fd >= 0 && fds[2 * i].revents) {
+                ssize_t n = read(d->from, buf, sizeof(buf));
+
+                if (n > 0)
+                    schedule(d, buf, n);
+                else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+                    d->eof = 1;
+            }
+
+            if (deliver(d) < 0)
+                return;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int sockfd, newsockfd, serverfd;
+    int portno, opt;
+    socklen_t clilen;
+    struct sockaddr_in serv_addr, cli_addr, target_addr;
+    struct hostent *server;
+
+    // -------------------------------------------------------------------------
+    // Options: -d delay_ms  -j jitter_ms  -b bytes_per_sec  -l loss_percent
+    // Arguments: listen_port server_host server_port
+    // -------------------------------------------------------------------------
+    while ((opt = getopt(argc, argv, "d:j:b:l:")) != -1) {
+        switch (opt) {
+        case 'd':
+            delay_ns = (uint64_t)(atof(optarg) * 1e6);
+            break;
+        case 'j':
+            jitter_ns = (uint64_t)(atof(optarg) * 1e6);
+            break;
+        case 'b':
+            bandwidth = strtoull(optarg, NULL, 10);
+            break;
+        case 'l':
+            loss = atof(optarg) / 100;
+            break;
+        default:
+            argc = 0;   // fall through to the usage message below
+        }
+    }
+    if (argc - optind < 3) {
+        fprintf(stderr, "usage %s [-d delay_ms] [-j jitter_ms] [-b bytes_per_sec] "
+                "[-l loss_pct] listen_port server_host server_port\n", argv[0]);
+        exit(1);
+    }
+
+    fastclock_init();
+    signal(SIGCHLD, SigCatcher);
+
+    // -------------------------------------------------------------------------
+    // Resolve the real server once; every child connects to it
+    // -------------------------------------------------------------------------
+    server = gethostbyname(argv[optind + 1]);
+    if (server == NULL) {
+        fprintf(stderr, "ERROR, no such host\n");
+        exit(1);
+    }
+    bzero((char *)&target_addr, sizeof(target_addr));
+    target_addr.sin_family = AF_INET;
+    bcopy((char *)server->h_addr, (char *)&target_addr.sin_addr.s_addr,
+          server->h_length);
+    target_addr.sin_port = htons(atoi(argv[optind + 2]));
+
+    // -------------------------------------------------------------------------
+    // Listening socket, as in fork_server.c
+    // -------------------------------------------------------------------------
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0)
+        error("ERROR opening socket");
+
+    bzero((char *)&serv_addr, sizeof(serv_addr));
+    portno = atoi(argv[optind]);
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(portno);
+
+    if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+        error("ERROR on binding");
+    listen(sockfd, SOMAXCONN);
+
+    // -------------------------------------------------------------------------
+    // Main loop: one child per client connection
+    // -------------------------------------------------------------------------
+    while (1) {
+        clilen = sizeof(cli_addr);
+        newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
+        if (newsockfd < 0) {
+            if (errno == EINTR)
+                continue;
+            error("ERROR on accept");
+        }
+
+        pid_t pid = fork();
+        if (pid < 0)
+            error("ERROR on fork");
+
+        if (pid == 0) {
+            // ---------------------- Child process ----------------------------
+            close(sockfd);
+            signal(SIGPIPE, SIG_IGN);
+            srand48(getpid() ^ fastclock_ns());
+
+            serverfd = socket(AF_INET, SOCK_STREAM, 0);
+            if (serverfd < 0)
+                error("ERROR opening socket");
+            if (connect(serverfd, (struct sockaddr *)&target_addr,
+                        sizeof(target_addr)) < 0)
+                error("ERROR connecting");
+
+            relay(newsockfd, serverfd);
+
+            close(serverfd);
+            close(newsockfd);
+            exit(0);
+        } else {
+            // ---------------------- Parent process ---------------------------
+            close(newsockfd);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,173 @@
+//   Live top-style view of a running fork_server:
+//   1) Opens the server's statistics region "/fork_server.<port>" read-only
+//   2) Once per second, copies the region into a local snapshot
+//   3) Prints rates (difference to the previous snapshot), the current
+//      gauges and latency percentiles for the last interval and since start
+//
+//   The server does no work for the monitor: it keeps updating the shared
+//   memory as usual, and the monitor only reads it (no syscalls or locks on
+//   the server side).
+//
+//   A server killed with SIGKILL cannot remove its region, so the monitor
+//   checks that the recorded pid still exists before every refresh and
+//   reports a stale region instead of showing frozen numbers as live.
+
+#include <stdio.h>      // printf, fprintf, perror
+#include <stdlib.h>     // exit, atoi
+#include <string.h>     // memcpy
+#include <unistd.h>     // sleep, close, isatty
+#include <errno.h>      // errno, ESRCH
+#include <signal.h>     // kill
+#include <fcntl.h>      // O_RDONLY
+#include <sys/mman.h>   // shm_open, mmap
+#include <sys/stat.h>   // mode constants for shm_open
+
+#include "stats.h"      // struct server_stats, sketch helpers
+
+// Print an error message (based on errno) and terminate the program.
+static void error(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+// Exits if the server that owns the region is no longer running
+static void check_alive(const struct server_stats *shared, const char *name)
+{
+    // kill(pid, 0) sends nothing; EPERM still means the process exists
+    if (kill(shared->pid, 0) < 0 && errno == ESRCH) {
+        fprintf(stderr, "ERROR, fork_server pid %d is gone, %s is stale\n",
+                shared->pid, name);
+        exit(1);
+    }
+}
+
+// Scales a byte rate into a short human-readable string
+static const char *human_bytes(double bytes, char *buf, size_t len)
+{
+    const char *units[] = { "B", "KB", "MB", "GB" };
+    int u = 0;
+
+    while (bytes >= 1024 && u < 3) {
+        bytes /= 1024;
+        u++;
+    }
+    snprintf(buf, len, "%.1f %s", bytes, units[u]);
+    return buf;
+}
+
+// One row of the per-child resource usage table, for one interval
+static void render_usage(const char *what, const struct rusage_hist *now,
+                         const struct rusage_hist *prev, uint64_t reaped)
+{
+    printf("  %-28s %9.1f %9lu %9lu\n", what,
+           reaped ? (double)(now->total - prev->total) / reaped : 0.0,
+           (unsigned long)hist_quantile(now, prev, 0.5),
+           (unsigned long)hist_quantile(now, prev, 0.99));
+}
+
+// -----------------------------------------------------------------------------
+// render():
+// Prints one screen from the current snapshot and the one taken 'secs'
+// seconds earlier.
+// -----------------------------------------------------------------------------
+static void render(const struct server_stats *now,
+                   const struct server_stats *prev, int secs, int clear)
+{
+    char in[32], out[32];
+
+    if (clear)
+        printf("\033[H\033[J");     // cursor home, clear screen
+
+    printf("fork_server pid %d\n\n", now->pid);
+
+    printf("connections/s %8.0f   requests/s %8.0f\n",
+           (double)(now->connections - prev->connections) / secs,
+           (double)(now->requests - prev->requests) / secs);
+    printf("bytes in/s %11s   bytes out/s %11s\n",
+           human_bytes((double)(now->bytes_in - prev->bytes_in) / secs,
+                       in, sizeof(in)),
+           human_bytes((double)(now->bytes_out - prev->bytes_out) / secs,
+                       out, sizeof(out)));
+    printf("running %6u   busy %6u   queued %6u   limit %6.1f   "
+           "stalls/s %6.0f\n\n",
+           now->running, now->busy, now->queued, now->limit,
+           (double)(now->stalls - prev->stalls) / secs);
+
+    printf("latency (us)       p50       p90       p99     p99.9\n");
+    printf("  last %2ds   %9.0f %9.0f %9.0f %9.0f\n", secs,
+           sketch_quantile(&now->latency, &prev->latency, 0.5),
+           sketch_quantile(&now->latency, &prev->latency, 0.9),
+           sketch_quantile(&now->latency, &prev->latency, 0.99),
+           sketch_quantile(&now->latency, &prev->latency, 0.999));
+    printf("  total      %9.0f %9.0f %9.0f %9.0f\n",
+           sketch_quantile(&now->latency, NULL, 0.5),
+           sketch_quantile(&now->latency, NULL, 0.9),
+           sketch_quantile(&now->latency, NULL, 0.99),
+           sketch_quantile(&now->latency, NULL, 0.999));
+
+    printf("\nper child (last %ds, %lu reaped)     mean    p50 <=    p99 <=\n",
+           secs, (unsigned long)(now->usage.reaped - prev->usage.reaped));
+    render_usage("cpu (us)", &now->usage.cpu_us, &prev->usage.cpu_us,
+                 now->usage.reaped - prev->usage.reaped);
+    render_usage("max rss (KB)", &now->usage.maxrss_kb, &prev->usage.maxrss_kb,
+                 now->usage.reaped - prev->usage.reaped);
+    render_usage("page faults", &now->usage.faults, &prev->usage.faults,
+                 now->usage.reaped - prev->usage.reaped);
+    render_usage("ctx switches", &now->usage.ctx_switches,
+                 &prev->usage.ctx_switches,
+                 now->usage.reaped - prev->usage.reaped);
+
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    const struct server_stats *shared;
+    static struct server_stats now, prev;   // ~10 KB each, keep off the stack
+    char name[64];
+    int fd, iterations, i;
+
+    // -------------------------------------------------------------------------
+    // Check command-line arguments:
+    //   ./monitor <port> [iterations]   (iterations = 0: run until killed)
+    // -------------------------------------------------------------------------
+    if (argc < 2) {
+        fprintf(stderr, "usage %s port [iterations]\n", argv[0]);
+        exit(1);
+    }
+    iterations = argc > 2 ? atoi(argv[2]) : 0;
+
+    // -------------------------------------------------------------------------
+    // Attach read-only to the server's statistics region
+    // -------------------------------------------------------------------------
+    stats_name(name, sizeof(name), atoi(argv[1]));
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        error("ERROR opening shared memory (is fork_server running?)");
+
+    shared = mmap(NULL, sizeof(*shared), PROT_READ, MAP_SHARED, fd, 0);
+    if (shared == MAP_FAILED)
+        error("ERROR mapping shared memory");
+    close(fd);
+
+    if (shared->magic != STATS_MAGIC) {
+        fprintf(stderr, "ERROR, %s has an unknown layout\n", name);
+        exit(1);
+    }
+    check_alive(shared, name);
+
+    // -------------------------------------------------------------------------
+    // Refresh loop: one snapshot per second
+    // -------------------------------------------------------------------------
+    memcpy(&prev, shared, sizeof(prev));
+    for (i = 0; iterations == 0 || i < iterations; i++) {
+        sleep(1);
+        check_alive(shared, name);
+        memcpy(&now, shared, sizeof(now));
+        render(&now, &prev, 1, isatty(STDOUT_FILENO));
+        memcpy(&prev, &now, sizeof(prev));
+    }
+
+    return 0;
+}
@@ -0,0 +1,187 @@
+// stats.h
+//   Layout of the statistics region that fork_server publishes in shared
+//   memory, and helpers to read it. Shared by:
+//     - fork_server.c : creates the region, parent and children update it
+//     - monitor.c     : attaches read-only and renders a live view
+//
+//   The region is a POSIX shared memory object named "/fork_server.<port>"
+//   (visible as /dev/shm/fork_server.<port>). Writers only use plain stores
+//   and atomic adds, so readers never take a lock and the server never makes
+//   a system call on their behalf.
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>     // uint32_t, uint64_t
+#include <stdio.h>      // snprintf
+#include <math.h>       // pow
+
+#define STATS_MAGIC        0x66737436u  // "fst6": layout version
+#define STATS_NAME_FMT     "/fork_server.%d"
+
+#define SKETCH_ALPHA       0.01   // DDSketch relative accuracy (1%)
+#define SKETCH_BUCKETS     1024   // covers 1 us .. ~11 min at 1% accuracy
+#define RUSAGE_BUCKETS     40     // log2 histogram buckets (values < 2^39)
+#define STATS_SLOTS        1024   // child slots, one per child table entry
+
+// -----------------------------------------------------------------------------
+// Latency sketch (DDSketch):
+// Bucket i counts latencies in (gamma^(i-1), gamma^i] microseconds, with
+// gamma = (1 + alpha) / (1 - alpha), so any percentile read back is within
+// alpha (1%) of the true value. Two sketches merge by adding their buckets,
+// which is what lets all children share one.
+// -----------------------------------------------------------------------------
+struct latency_sketch {
+    uint64_t count;
+    uint64_t buckets[SKETCH_BUCKETS];
+};
+
+// -----------------------------------------------------------------------------
+// Per-child resource usage:
+// Filled from the struct rusage wait4() returns for every reaped child.
+// Each histogram is log2: bucket i counts values in [2^(i-1), 2^i), bucket 0
+// counts zeros. The totals give exact means.
+// -----------------------------------------------------------------------------
+struct rusage_hist {
+    uint64_t total;
+    uint64_t buckets[RUSAGE_BUCKETS];
+};
+
+struct child_usage {
+    uint64_t reaped;                // children accounted
+    struct rusage_hist cpu_us;      // user + system CPU time
+    struct rusage_hist maxrss_kb;   // peak resident set size
+    struct rusage_hist faults;      // minor + major page faults
+    struct rusage_hist ctx_switches;// voluntary + involuntary
+};
+
+// -----------------------------------------------------------------------------
+// Child slots:
+// fork_server gives each child table entry one slot. The parent resets it
+// before fork(); the child then reports what it is doing, which lets the
+// parent tell children handling a request from those still waiting for the
+// client's message. Proxy children report which backends they tried.
+// -----------------------------------------------------------------------------
+enum slot_state {
+    SLOT_WAITING,               // forked, waiting for the client's message
+    SLOT_HANDLING,              // message read, reply not yet written
+    SLOT_DONE                   // reply written, latency_ns is valid
+};
+
+struct child_slot {
+    uint64_t accepted_ns;       // accept() time of the connection (parent)
+    uint64_t latency_ns;        // accept -> reply written, without the wait
+                                // for the client's message (child)
+    uint32_t state;             // enum slot_state (child)
+    int32_t backend;            // proxy: backend relayed to, -1 = none
+    uint32_t failed;            // proxy: bit i set = backend i unreachable
+};
+
+// -----------------------------------------------------------------------------
+// Statistics region:
+// Counters only ever grow; readers compute rates from two snapshots.
+// Gauges are overwritten by the parent on every main loop iteration.
+// -----------------------------------------------------------------------------
+struct server_stats {
+    uint32_t magic;             // STATS_MAGIC once the region is ready
+    int32_t pid;                // parent process id
+
+    // counters (parent)
+    uint64_t connections;       // connections accepted
+
+    // counters (children, atomic adds)
+    uint64_t requests;          // requests answered by dostuff()
+    uint64_t bytes_in;          // bytes received from clients
+    uint64_t bytes_out;         // bytes sent to clients
+    uint64_t stalls;            // handlers that exceeded the stall threshold
+
+    // gauges (parent)
+    uint32_t running;           // children running
+    uint32_t busy;              // children handling a request
+    uint32_t queued;            // connections waiting in tenant queues
+    double limit;               // current concurrency limit
+
+    struct latency_sketch latency;  // accept -> reply, all children merged
+    struct child_usage usage;       // rusage of reaped children (parent)
+    struct child_slot slots[STATS_SLOTS];   // one per child table entry
+};
+
+// Builds the shared memory object name for a port
+static inline void stats_name(char *buf, size_t len, int port)
+{
+    snprintf(buf, len, STATS_NAME_FMT, port);
+}
+
+// Maps bucket i back to a latency in microseconds (bucket midpoint)
+static inline double sketch_value(int i)
+{
+    double gamma = (1 + SKETCH_ALPHA) / (1 - SKETCH_ALPHA);
+
+    return 2 * pow(gamma, i) / (gamma + 1);
+}
+
+// -----------------------------------------------------------------------------
+// sketch_quantile():
+// Returns the q-quantile (0..1) in microseconds of the difference between
+// two sketches, 'now' minus 'before'. Pass before == NULL for everything
+// recorded so far. Returns 0 if no samples fall in between.
+// -----------------------------------------------------------------------------
+static inline double sketch_quantile(const struct latency_sketch *now,
+                                     const struct latency_sketch *before,
+                                     double q)
+{
+    uint64_t count = 0, rank, seen = 0;
+    int i;
+
+    for (i = 0; i < SKETCH_BUCKETS; i++)
+        count += now->buckets[i] - (before ? before->buckets[i] : 0);
+    if (count == 0)
+        return 0;
+
+    rank = (uint64_t)(q * (count - 1));
+    for (i = 0; i < SKETCH_BUCKETS - 1; i++) {
+        seen += now->buckets[i] - (before ? before->buckets[i] : 0);
+        if (seen > rank)
+            break;
+    }
+    return sketch_value(i);
+}
+
+// Adds one value to a log2 histogram
+static inline void hist_add(struct rusage_hist *h, uint64_t v)
+{
+    int i = v == 0 ? 0 : 64 - __builtin_clzll(v);
+
+    if (i >= RUSAGE_BUCKETS)
+        i = RUSAGE_BUCKETS - 1;
+    h->buckets[i]++;
+    h->total += v;
+}
+
+// -----------------------------------------------------------------------------
+// hist_quantile():
+// Returns an upper bound (2^i - 1) for the q-quantile of a log2 histogram,
+// or 0 if it is empty. Like sketch_quantile(), 'before' may be NULL.
+// -----------------------------------------------------------------------------
+static inline uint64_t hist_quantile(const struct rusage_hist *now,
+                                     const struct rusage_hist *before,
+                                     double q)
+{
+    uint64_t count = 0, rank, seen = 0;
+    int i;
+
+    for (i = 0; i < RUSAGE_BUCKETS; i++)
+        count += now->buckets[i] - (before ? before->buckets[i] : 0);
+    if (count == 0)
+        return 0;
+
+    rank = (uint64_t)(q * (count - 1));
+    for (i = 0; i < RUSAGE_BUCKETS - 1; i++) {
+        seen += now->buckets[i] - (before ? before->buckets[i] : 0);
+        if (seen > rank)
+            break;
+    }
+    return i == 0 ? 0 : (1ULL << i) - 1;
+}
+
+#endif // STATS_H